@@ -16,6 +16,10 @@
 #include <freeglut.h>
 #include <math.h>
 #include <stdio.h>
+#include <float.h>
+#ifdef _OPENMP
+#include <omp.h>
+#endif
 
 #define PI 3.14159265359
 
@@ -61,6 +65,44 @@ GLfloat boidAvoidanceFactor = 0.000007;
 GLfloat boidAlignmentFactor = 0.0000002;
 GLfloat boidCohesionFactor = 0.0000005;
 
+// Update path variables. The fused update does the neighbour search, the boid rules and the
+// position update in one pass. Turning on validateFused (the v key) runs the old multi-pass
+// update alongside it every frame and prints any boid where the two disagree.
+// The boid rules only change a velocity by 1e-7 to 1e-5 a step, so the velocity tolerance has to
+// be well under the smallest rule factor (alignment) to catch a broken rule, but above the 1e-9
+// or so that float rounding leaves between the two paths. Positions are around 250, where a float
+// can only be trusted to a few 1e-5, so they get their own looser tolerance
+#define VELOCITY_TOLERANCE 0.00000001
+#define POSITION_TOLERANCE 0.0001
+GLint fusedUpdate = 1;
+GLint validateFused = 0;
+
+// Deterministic mode variables. In deterministic mode every step only reads the previous flock, so
+// the same seed gives the same flock on any number of threads. The flock hash is printed every
+// HASH_LOG_INTERVAL steps so two runs can be compared, and BENCHMARK_STEPS is how many steps each
+// mode is timed for when comparing their speed
+#define HASH_LOG_INTERVAL 100
+#define BENCHMARK_STEPS 20000
+GLint deterministicUpdate = 0;
+GLuint randomSeed = 1;
+GLint stepCount = 0;
+
+// Splitting a step across threads costs more than it saves for small flocks, so the deterministic
+// update starts out parallel only if the flock is at least this big. The p key switches it either
+// way, and OMP_NUM_THREADS sets how many threads are used
+#define PARALLEL_FLOCK_SIZE 1000
+GLint parallelUpdate = FLOCK_SIZE >= PARALLEL_FLOCK_SIZE;
+
+// Returns how many threads the deterministic update is using, 1 if it isn't running in parallel or
+// the program was built without OpenMP
+GLint getUpdateThreadCount()
+{
+#ifdef _OPENMP
+	if (parallelUpdate) return omp_get_max_threads();
+#endif
+	return 1;
+}
+
 GLfloat getDistance(GLfloat x1, GLfloat x2, GLfloat y1, GLfloat y2)
 {
 	return (GLfloat)sqrt(pow((x2 - x1), 2) + pow((y2 - y1), 2));
@@ -121,6 +163,10 @@ void initializeBoids()
 	GLint spawnMaxX = windowWidth - spawnThreshold;
 	GLint spawnMinY = subWindowHeight + spawnThreshold;
 	GLint spawnMaxY = windowHeight - spawnThreshold;
+
+	// Seed rand so the same seed always spawns the same flock
+	srand(randomSeed);
+	stepCount = 0;
 	
 	for (GLint i = 0; i < FLOCK_SIZE; i++)
 	{
@@ -457,6 +503,333 @@ void updateBoids()
 	}
 }
 
+/**
+* Finds boid index's NUMBER_NEIGHBOURS closest boids in the given flock in a single pass. Each
+* boid is insertion sorted into a small list of squared distances, and anything further away
+* than the last neighbour we are keeping is skipped, so most boids don't move anything. Ties go
+* to the lower index so the list is always in the same order for the same flock.
+*/
+void findNearestNeighboursSquared(Boid* flock, GLint index, GLint* nearestNeighbours, GLfloat* nearestDistances)
+{
+	Vector2 position = flock[index].position;
+
+	for (GLint k = 0; k < NUMBER_NEIGHBOURS; k++)
+	{
+		nearestNeighbours[k] = index;
+		nearestDistances[k] = FLT_MAX;
+	}
+
+	for (GLint j = 0; j < FLOCK_SIZE; j++)
+	{
+		if (j == index)
+			continue;
+
+		GLfloat dx = flock[j].position.x - position.x;
+		GLfloat dy = flock[j].position.y - position.y;
+		GLfloat distanceSquared = dx * dx + dy * dy;
+
+		if (distanceSquared >= nearestDistances[NUMBER_NEIGHBOURS - 1])
+			continue;
+
+		GLint k = NUMBER_NEIGHBOURS - 1;
+		while (k > 0 && distanceSquared < nearestDistances[k - 1])
+		{
+			nearestDistances[k] = nearestDistances[k - 1];
+			nearestNeighbours[k] = nearestNeighbours[k - 1];
+			k--;
+		}
+		nearestDistances[k] = distanceSquared;
+		nearestNeighbours[k] = j;
+	}
+}
+
+/**
+* Applies either the wall avoidance or the three boid rules to boid i and moves it, reading only
+* previousFlock and writing only currentFlock[i]. This does the same thing as avoidWalls or
+* handleBoidRules plus the position update in updateBoids, but reuses the squared distances from
+* the neighbour search. A cached distance is only the distance between the previous positions if
+* the neighbour hadn't moved when it was measured. boidsMovedThisStep is how many boids (counting
+* from index 0) had already moved in the flock that was searched, and any neighbour among them is
+* measured again.
+*/
+void applyRulesAndMoveBoid(GLint i, GLint* nearestNeighbours, GLfloat* nearestDistances, GLint boidsMovedThisStep)
+{
+	Boid previous = previousFlock[i];
+	Vector2 velocity = previous.velocity;
+
+	GLubyte inProximity = inProximityOfHorizontal(i) | inProximityOfVertical(i);
+	if (inProximity > 0)
+	{
+		avoidWalls(i, inProximity);
+		velocity = currentFlock[i].velocity;
+	}
+	else
+	{
+		Vector2 alignment = { 0, 0 };
+		Vector2 cohesion = { 0, 0 };
+		Vector2 separation = { 0, 0 };
+
+		for (GLint k = 0; k < NUMBER_NEIGHBOURS; k++)
+		{
+			Boid neighbour = previousFlock[nearestNeighbours[k]];
+
+			alignment.x += neighbour.velocity.x;
+			alignment.y += neighbour.velocity.y;
+
+			cohesion.x += neighbour.position.x;
+			cohesion.y += neighbour.position.y;
+
+			Vector2 directionAway =
+			{
+				previous.position.x - neighbour.position.x,
+				previous.position.y - neighbour.position.y
+			};
+
+			GLfloat distanceSquared = nearestDistances[k];
+			if (nearestNeighbours[k] < boidsMovedThisStep)
+			{
+				distanceSquared = directionAway.x * directionAway.x + directionAway.y * directionAway.y;
+			}
+
+			if (distanceSquared < boidDistance * boidDistance)
+			{
+				GLfloat distance = (GLfloat)sqrt(distanceSquared);
+
+				normalize(&directionAway);
+				directionAway.x *= (1.0 / distance) * boidAvoidanceFactor;
+				directionAway.y *= (1.0 / distance) * boidAvoidanceFactor;
+
+				separation.x += directionAway.x;
+				separation.y += directionAway.y;
+			}
+		}
+
+		alignment.x = alignment.x / NUMBER_NEIGHBOURS - previous.velocity.x;
+		alignment.y = alignment.y / NUMBER_NEIGHBOURS - previous.velocity.y;
+		normalize(&alignment);
+		applyFactor(&alignment, boidAlignmentFactor);
+
+		cohesion.x = cohesion.x / NUMBER_NEIGHBOURS - previous.position.x;
+		cohesion.y = cohesion.y / NUMBER_NEIGHBOURS - previous.position.y;
+		normalize(&cohesion);
+		applyFactor(&cohesion, boidCohesionFactor);
+
+		velocity.x += alignment.x + cohesion.x + separation.x;
+		velocity.y += alignment.y + cohesion.y + separation.y;
+
+		GLfloat currentSpeed = getMagnitude(velocity.x, velocity.y);
+		if (currentSpeed > flockSpeed)
+		{
+			velocity.x = (velocity.x / currentSpeed) * flockSpeed;
+			velocity.y = (velocity.y / currentSpeed) * flockSpeed;
+		}
+	}
+
+	currentFlock[i].velocity = velocity;
+	currentFlock[i].position.x = previous.position.x + velocity.x;
+	currentFlock[i].position.y = previous.position.y + velocity.y;
+}
+
+/**
+* The fused version of updateBoids. Instead of filling and sorting a list of every boid and then
+* going back over the neighbours in handleBoidRules, each boid makes a single pass over the flock
+* to find its neighbours, then adds up alignment, cohesion and separation and moves straight away.
+* To give the same result as updateBoids, the search is done on currentFlock, so boids earlier in
+* the list are found where they have already moved to this update.
+*/
+void updateBoidsFused()
+{
+	setAllBoidsColourBlue();
+	for (GLint i = 0; i < FLOCK_SIZE; i++)
+	{
+		GLint nearestNeighbours[NUMBER_NEIGHBOURS];
+		GLfloat nearestDistances[NUMBER_NEIGHBOURS];
+		findNearestNeighboursSquared(currentFlock, i, nearestNeighbours, nearestDistances);
+
+		if (i == boidState)
+		{
+			handleBoidState(boidState, nearestNeighbours);
+		}
+
+		// Boids 0 to i - 1 have already moved in currentFlock, so their distances are measured again
+		applyRulesAndMoveBoid(i, nearestNeighbours, nearestDistances, i);
+	}
+}
+
+/**
+* The deterministic version of updateBoidsFused. Every boid searches and applies the rules using
+* previousFlock only, so the result doesn't depend on what order the boids are updated in and the
+* loop can be split across threads without changing a single bit of the output. Each boid adds up
+* its neighbours in the same sorted order every time, and the highlighting is done after the loop
+* since it writes the colour of other boids.
+*/
+void updateBoidsDeterministic()
+{
+	setAllBoidsColourBlue();
+
+	#pragma omp parallel for if (parallelUpdate)
+	for (GLint i = 0; i < FLOCK_SIZE; i++)
+	{
+		GLint nearestNeighbours[NUMBER_NEIGHBOURS];
+		GLfloat nearestDistances[NUMBER_NEIGHBOURS];
+		findNearestNeighboursSquared(previousFlock, i, nearestNeighbours, nearestDistances);
+
+		// previousFlock was searched, where no boid has moved yet, so every cached distance is used
+		applyRulesAndMoveBoid(i, nearestNeighbours, nearestDistances, 0);
+	}
+
+	if (boidState >= 0 && boidState < FLOCK_SIZE)
+	{
+		GLint nearestNeighbours[NUMBER_NEIGHBOURS];
+		GLfloat nearestDistances[NUMBER_NEIGHBOURS];
+		findNearestNeighboursSquared(previousFlock, boidState, nearestNeighbours, nearestDistances);
+
+		handleBoidState(boidState, nearestNeighbours);
+	}
+}
+
+/**
+* Hashes the position and velocity of every boid in the current flock, in index order, using
+* 32 bit FNV-1a over the raw bytes. Two runs that print the same hash for the same step have
+* bit-identical flocks, so this can be logged to compare runs with different thread counts.
+*/
+GLuint getFlockHash()
+{
+	GLuint hash = 2166136261u;
+
+	for (GLint i = 0; i < FLOCK_SIZE; i++)
+	{
+		Vector2 state[2] = { currentFlock[i].position, currentFlock[i].velocity };
+		unsigned char* bytes = (unsigned char*)state;
+
+		for (GLint b = 0; b < (GLint)sizeof(state); b++)
+		{
+			hash ^= bytes[b];
+			hash *= 16777619u;
+		}
+	}
+
+	return hash;
+}
+
+/**
+* Runs both updateBoids and updateBoidsFused from the same starting flock and prints every boid
+* whose position differs by more than POSITION_TOLERANCE, or whose change in velocity this step
+* differs by more than VELOCITY_TOLERANCE. The fused result is the one that is kept. Only used when
+* validateFused is turned on.
+*
+* If two boids are at exactly the same float distance for the last neighbour spot, the two paths
+* can pick different ones, which shows up as a mismatch about the size of the alignment factor.
+* This happens very rarely (3 boids in 20000 steps from the default seed).
+*/
+void validateFusedUpdate()
+{
+	Boid startingFlock[FLOCK_SIZE];
+	Boid multiPassFlock[FLOCK_SIZE];
+
+	for (GLint i = 0; i < FLOCK_SIZE; i++)
+		startingFlock[i] = currentFlock[i];
+
+	updateBoids();
+
+	for (GLint i = 0; i < FLOCK_SIZE; i++)
+	{
+		multiPassFlock[i] = currentFlock[i];
+		currentFlock[i] = startingFlock[i];
+	}
+
+	updateBoidsFused();
+
+	for (GLint i = 0; i < FLOCK_SIZE; i++)
+	{
+		GLfloat positionError = getDistance(multiPassFlock[i].position.x, currentFlock[i].position.x,
+			multiPassFlock[i].position.y, currentFlock[i].position.y);
+
+		// Compare how much each path changed the velocity by rather than the velocities themselves,
+		// the rules only make small changes to a much bigger velocity
+		Vector2 multiPassChange =
+		{
+			multiPassFlock[i].velocity.x - previousFlock[i].velocity.x,
+			multiPassFlock[i].velocity.y - previousFlock[i].velocity.y
+		};
+		Vector2 fusedChange =
+		{
+			currentFlock[i].velocity.x - previousFlock[i].velocity.x,
+			currentFlock[i].velocity.y - previousFlock[i].velocity.y
+		};
+		GLfloat velocityError = getDistance(multiPassChange.x, fusedChange.x, multiPassChange.y, fusedChange.y);
+
+		if (positionError > POSITION_TOLERANCE || velocityError > VELOCITY_TOLERANCE)
+		{
+			printf("Fused update mismatch on boid %d: position off by %g, velocity change off by %g (change was %g)\n",
+				i, positionError, velocityError, getMagnitude(multiPassChange.x, multiPassChange.y));
+		}
+	}
+}
+
+/**
+* Times BENCHMARK_STEPS steps of the given update function starting from the current flock, and
+* returns how many milliseconds it took. The flock is put back afterwards so the simulation
+* carries on from where it was.
+*/
+GLint timeUpdate(void (*update)())
+{
+	Boid savedCurrentFlock[FLOCK_SIZE];
+	Boid savedPreviousFlock[FLOCK_SIZE];
+
+	for (GLint i = 0; i < FLOCK_SIZE; i++)
+	{
+		savedCurrentFlock[i] = currentFlock[i];
+		savedPreviousFlock[i] = previousFlock[i];
+	}
+
+	GLint startTime = glutGet(GLUT_ELAPSED_TIME);
+	for (GLint step = 0; step < BENCHMARK_STEPS; step++)
+	{
+		update();
+		copyCurrentFlockToPrevious();
+	}
+	GLint time = glutGet(GLUT_ELAPSED_TIME) - startTime;
+
+	for (GLint i = 0; i < FLOCK_SIZE; i++)
+	{
+		currentFlock[i] = savedCurrentFlock[i];
+		previousFlock[i] = savedPreviousFlock[i];
+	}
+
+	// Avoid dividing by zero on a very fast machine
+	return time < 1 ? 1 : time;
+}
+
+/**
+* Compares the speed of the fast (fused) update with the deterministic update, first on one thread
+* and then on every thread OpenMP gives us, and prints the steps per second of each and how much
+* slower than the fast mode it is. The parallel run is skipped if there is only one thread.
+*/
+void compareUpdateThroughput()
+{
+	GLint savedParallelUpdate = parallelUpdate;
+
+	GLint fusedTime = timeUpdate(updateBoidsFused);
+	printf("Fast mode          (1 thread)  : %8.0f steps/s\n", BENCHMARK_STEPS * 1000.0 / fusedTime);
+
+	parallelUpdate = 0;
+	GLint serialTime = timeUpdate(updateBoidsDeterministic);
+	printf("Deterministic mode (1 thread)  : %8.0f steps/s, %+.1f%% time per step\n",
+		BENCHMARK_STEPS * 1000.0 / serialTime, (serialTime - fusedTime) * 100.0 / fusedTime);
+
+	parallelUpdate = 1;
+	GLint threads = getUpdateThreadCount();
+	if (threads > 1)
+	{
+		GLint parallelTime = timeUpdate(updateBoidsDeterministic);
+		printf("Deterministic mode (%d threads) : %8.0f steps/s, %+.1f%% time per step\n",
+			threads, BENCHMARK_STEPS * 1000.0 / parallelTime, (parallelTime - fusedTime) * 100.0 / fusedTime);
+	}
+
+	parallelUpdate = savedParallelUpdate;
+}
+
 // Set the background to black
 void initializeGL(void)
 {
@@ -616,8 +989,17 @@ void idleBoids()
 {
 	if (pauseState == 0)
 	{
-		updateBoids();
+		if (deterministicUpdate) updateBoidsDeterministic();
+		else if (validateFused) validateFusedUpdate();
+		else if (fusedUpdate) updateBoidsFused();
+		else updateBoids();
 		copyCurrentFlockToPrevious();
+
+		stepCount++;
+		if (deterministicUpdate && stepCount % HASH_LOG_INTERVAL == 0)
+		{
+			printf("Step %d hash: %08x (threads: %d)\n", stepCount, getFlockHash(), getUpdateThreadCount());
+		}
 		glutPostRedisplay();
 	}
 }
@@ -665,7 +1047,10 @@ void handleSpecialKeyboard(unsigned char key, GLint x, GLint y)
 }
 
 // Handles the other keys, 1-9 set the boid state and draws the boids as the different colors,
-// 0 sets it back to standard boid drawing, and q quits the program
+// 0 sets it back to standard boid drawing, f switches between the fused and multi-pass update,
+// v checks the fused update against the multi-pass update every step, d restarts the flock in or
+// out of deterministic mode, p runs the deterministic update on one or many threads, b compares
+// the speed of the fast and deterministic updates, and q quits the program
 void handleKeyboard(unsigned char key, GLint x, GLint y)
 {
 	if (key >= '1' && key <= '9')
@@ -676,6 +1061,33 @@ void handleKeyboard(unsigned char key, GLint x, GLint y)
 	{
 		boidState = -1 - '0';
 	}
+	else if (key == 'F' || key == 'f')
+	{
+		fusedUpdate = !fusedUpdate;
+		printf("Fused update: %s\n", fusedUpdate ? "on" : "off");
+	}
+	else if (key == 'V' || key == 'v')
+	{
+		validateFused = !validateFused;
+		printf("Fused update validation: %s\n", validateFused ? "on" : "off");
+	}
+	else if (key == 'D' || key == 'd')
+	{
+		// Start the flock again from the seed so the logged hashes can be compared between runs
+		deterministicUpdate = !deterministicUpdate;
+		initializeBoids();
+		printf("Deterministic update: %s (seed %u)\n", deterministicUpdate ? "on" : "off", randomSeed);
+	}
+	else if (key == 'P' || key == 'p')
+	{
+		// The hashes don't change when this is switched, so there is no need to restart the flock
+		parallelUpdate = !parallelUpdate;
+		printf("Parallel deterministic update: %s (threads: %d)\n", parallelUpdate ? "on" : "off", getUpdateThreadCount());
+	}
+	else if (key == 'B' || key == 'b')
+	{
+		compareUpdateThroughput();
+	}
 	else if (key == 'Q' || key == 'q')
 	{
 		exit(0);
@@ -692,6 +1104,11 @@ void initialPrintStatement()
 	printf("Page Down : slower\n");
 	printf("[1-9]     : highlight boid and its neighbours\n");
 	printf("0         : turn off highlighting\n");
+	printf("f         : toggle fused update\n");
+	printf("v         : toggle fused update validation (f has no effect, off in deterministic mode)\n");
+	printf("d         : toggle deterministic update (restarts the flock)\n");
+	printf("p         : toggle parallel deterministic update\n");
+	printf("b         : compare fast and deterministic update speed\n");
 	printf("q         : quit\n");
 	printf("\nNote: may need to use FN keys to use Page Up and Page Down on Laptops\n\n");
 }